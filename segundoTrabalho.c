@@ -7,6 +7,10 @@
 #include <string.h>
 #include <time.h>
 
+#if !defined(__WIN32) && !defined(__WIN64)
+#include <sys/resource.h>
+#endif
+
 #define DEBUG false
 
 // Desabilita cores automaticamente no windows
@@ -19,6 +23,15 @@
 #define MAX_LINES 1000
 #define MAX_COLUMNS 1000
 
+// Limite da memória alocada pelo programa em cada processo, em bytes
+// Conta o pool de buffers e, no processo 0, as matrizes completas e o texto
+// usado para exibi-las. A execução não começa se algum processo exceder
+// Pode ser alterado na compilação com -DMAX_MEMORY_BYTES=<bytes>
+#ifndef MAX_MEMORY_BYTES
+#define MAX_MEMORY_BYTES (32 * 1024 * 1024)
+#endif
+#define POOL_ALIGNMENT 16
+
 #define CONTROLLER_PROCESS 0
 
 #define LINE_INDEX_TAG 2
@@ -54,12 +67,40 @@ typedef struct {
   cached_element_t *top_line;
 } line_data_t;
 
+/*
+  buffer_pool_t
+  Estrutura de dados para o pool de memória do processo
+  Alocado uma única vez no início, as linhas e requisições são retiradas dele
+  em sequência e liberadas todas juntas no final
+*/
+typedef struct {
+  char *memory;
+  size_t capacity;
+  size_t used;
+  int process_id;
+} buffer_pool_t;
+
+/*
+  comm_t
+  Estrutura de dados para a comunicação de elementos com os processos vizinhos
+  As requisições são persistentes e ficam ligadas a um buffer fixo de um
+  elemento, então cada envio ou recebimento só precisa de um MPI_Start
+*/
+typedef struct {
+  MPI_Request element_send;
+  MPI_Request element_recv;
+  int element_out;
+  int element_in;
+  bool send_pending;
+} comm_t;
+
 /*
   process_data_t
   Estrutura de dados para armazenar informações sobre o processo
   Como a quantidade de linhas a serem processadas por ele
   O número de linhas e colunas da matriz
-  E o id do processo
+  O id do processo
+  E a comunicação com os processos vizinhos
 */
 typedef struct {
   int number_of_lines;
@@ -67,6 +108,7 @@ typedef struct {
   int process_id;
   int process_count;
   int lines_to_process;
+  comm_t *comm;
 } process_data_t;
 
 /*
@@ -106,17 +148,215 @@ typedef struct {
   } while (0)
 
 /*
-  create_tag
-  Função para criar uma tag para mensagens MPI
-  A tag é composta por um identificador de tipo de mensagem
-  O índice da linha e o índice da coluna
+  pool_round
+  Função para arredondar um tamanho para o alinhamento do pool
+*/
+size_t pool_round(size_t bytes) {
+  return (bytes + POOL_ALIGNMENT - 1) / POOL_ALIGNMENT * POOL_ALIGNMENT;
+}
+
+/*
+  pool_bytes_needed
+  Função para calcular o tamanho do pool de um processo
+  O processo 0 usa a própria matriz para as suas linhas, então precisa apenas
+  da linha anterior e, para cada outro processo, de uma linha e uma requisição
+  para receber as linhas prontas
+  Os demais processos precisam das suas linhas, da linha seguinte de cada uma,
+  da linha anterior e de uma linha para devolver as linhas prontas
+*/
+size_t pool_bytes_needed(int id, int np, int number_of_lines,
+                         int number_of_columns) {
+  size_t lines_per_process = number_of_lines / np;
+  size_t line_bytes = pool_round(number_of_columns * sizeof(int));
+  size_t bytes = pool_round(number_of_columns * sizeof(cached_element_t));
+
+  if (id == CONTROLLER_PROCESS) {
+    bytes += (np - 1) * line_bytes;
+    bytes += pool_round((np - 1) * sizeof(MPI_Request));
+  } else {
+    bytes += (2 * lines_per_process + 1) * line_bytes;
+  }
+
+  return bytes;
+}
+
+/*
+  incremental_pool_bytes_needed
+  Função para calcular o tamanho do pool do processo 0 no modo incremental
+  Precisa da linha anterior e da primeira coluna afetada de cada linha
+*/
+size_t incremental_pool_bytes_needed(int number_of_lines,
+                                     int number_of_columns) {
+  return pool_round(number_of_columns * sizeof(cached_element_t)) +
+         pool_round(number_of_lines * sizeof(int));
+}
+
+/*
+  matrix_bytes
+  Função para calcular a memória de uma matriz alocada por allocate_matrix
+*/
+size_t matrix_bytes(int number_of_lines, int number_of_columns) {
+  return (size_t)number_of_lines *
+         (sizeof(int *) + (size_t)number_of_columns * sizeof(int));
+}
+
+/*
+  controller_matrix_bytes
+  Função para calcular a memória do processo 0 fora do pool
+  São a matriz gerada, a cópia da entrada, a matriz de referência quando o
+  estado é salvo e o texto montado por display_matrix
+*/
+size_t controller_matrix_bytes(int number_of_lines, int number_of_columns,
+                               bool saving_state) {
+  int matrices = saving_state ? 3 : 2;
+
+  return matrices * matrix_bytes(number_of_lines, number_of_columns) +
+         (size_t)number_of_columns * number_of_lines * 6;
+}
+
+/*
+  incremental_matrix_bytes
+  Função para calcular a memória do modo incremental fora do pool
+  São a entrada, a saída anterior, a nova saída e o texto montado por
+  display_matrix
+*/
+size_t incremental_matrix_bytes(int number_of_lines, int number_of_columns) {
+  return 3 * matrix_bytes(number_of_lines, number_of_columns) +
+         (size_t)number_of_columns * number_of_lines * 6;
+}
+
+/*
+  pool_init
+  Função para alocar o pool de memória com a capacidade informada
+  Aborta a execução se não há memória suficiente
+*/
+void pool_init(buffer_pool_t *pool, int id, size_t capacity) {
+  pool->memory = (char *)malloc(capacity);
+  pool->capacity = capacity;
+  pool->used = 0;
+  pool->process_id = id;
+
+  if (pool->memory == NULL && capacity > 0) {
+    info(id, "ERRO! Não foi possível alocar o pool de %zu bytes", capacity);
+    MPI_Abort(MPI_COMM_WORLD, 1);
+  }
+}
+
+/*
+  pool_take
+  Função para retirar um buffer do pool
+  Aborta a execução se o pool não tem espaço suficiente, o que indica que
+  pool_bytes_needed não corresponde aos buffers realmente usados
+*/
+void *pool_take(buffer_pool_t *pool, size_t bytes) {
+  bytes = pool_round(bytes);
+
+  if (pool->used + bytes > pool->capacity) {
+    info(pool->process_id,
+         "ERRO! Pool sem espaço, pedido %zu bytes com %zu de %zu usados", bytes,
+         pool->used, pool->capacity);
+    MPI_Abort(MPI_COMM_WORLD, 1);
+  }
 
-  Ficam 12 bits para a tag
-  10 bits para o índice da linha
-  10 bits para o índice da coluna
+  void *buffer = pool->memory + pool->used;
+  pool->used += bytes;
+
+  return buffer;
+}
+
+/*
+  pool_free
+  Função para liberar o pool e todos os buffers retirados dele
 */
-int create_tag(int tag, int line_index, int column_index) {
-  return (tag) << 20 | (line_index << 10) | column_index;
+void pool_free(buffer_pool_t *pool) {
+  free(pool->memory);
+  pool->memory = NULL;
+  pool->capacity = 0;
+  pool->used = 0;
+}
+
+/*
+  report_memory
+  Função para informar a memória alocada pelo programa e o pico de memória do
+  processo, que inclui também a memória da biblioteca MPI
+  O pico de memória não está disponível no windows
+*/
+void report_memory(int id, buffer_pool_t *pool, size_t outside_pool_bytes) {
+  long peak_kb = -1;
+
+#if !defined(__WIN32) && !defined(__WIN64)
+  struct rusage usage;
+
+  if (getrusage(RUSAGE_SELF, &usage) == 0) {
+    peak_kb = usage.ru_maxrss;
+  }
+#endif
+
+  info(id,
+       "Memória alocada %zu bytes (pool %zu de %zu, matrizes %zu, limite %zu), "
+       "pico de memória %ld KB",
+       pool->capacity + outside_pool_bytes, pool->used, pool->capacity,
+       outside_pool_bytes,
+       (size_t)MAX_MEMORY_BYTES, peak_kb);
+}
+
+/*
+  comm_init
+  Função para criar as requisições persistentes de elementos
+  Os elementos prontos são enviados ao processo seguinte e os da linha anterior
+  recebidos do processo anterior. Como a ordem das mensagens entre dois
+  processos é preservada, uma única tag identifica todos os elementos
+*/
+void comm_init(comm_t *comm, int id, int np) {
+  int next_process_id = (id + 1) % np;
+  int prev_process_id = (id - 1 + np) % np;
+
+  MPI_Send_init(&comm->element_out, 1, MPI_INT, next_process_id,
+                DONE_ELEMENT_TAG, MPI_COMM_WORLD, &comm->element_send);
+  MPI_Recv_init(&comm->element_in, 1, MPI_INT, prev_process_id,
+                DONE_ELEMENT_TAG, MPI_COMM_WORLD, &comm->element_recv);
+
+  comm->send_pending = false;
+}
+
+/*
+  send_element
+  Função para enviar um elemento pronto ao processo seguinte
+  Aguarda o envio anterior para poder reaproveitar o buffer da requisição
+*/
+void send_element(comm_t *comm, int value) {
+  if (comm->send_pending) {
+    MPI_Wait(&comm->element_send, MPI_STATUS_IGNORE);
+  }
+
+  comm->element_out = value;
+  MPI_Start(&comm->element_send);
+  comm->send_pending = true;
+}
+
+/*
+  recv_element
+  Função para receber o próximo elemento pronto do processo anterior
+*/
+int recv_element(comm_t *comm) {
+  MPI_Start(&comm->element_recv);
+  MPI_Wait(&comm->element_recv, MPI_STATUS_IGNORE);
+
+  return comm->element_in;
+}
+
+/*
+  comm_free
+  Função para concluir o último envio e liberar as requisições persistentes
+*/
+void comm_free(comm_t *comm) {
+  if (comm->send_pending) {
+    MPI_Wait(&comm->element_send, MPI_STATUS_IGNORE);
+    comm->send_pending = false;
+  }
+
+  MPI_Request_free(&comm->element_send);
+  MPI_Request_free(&comm->element_recv);
 }
 
 /*
@@ -231,6 +471,150 @@ void display_matrix(int **matrix, int number_of_lines, int number_of_columns) {
   free(matrix_to_print);
 }
 
+/*
+  allocate_matrix
+  Função para alocar uma matriz sem inicializar seus valores
+  Recebe o número de linhas e colunas da matriz
+  Retorna um ponteiro para a matriz alocada
+*/
+int **allocate_matrix(int number_of_lines, int number_of_columns) {
+  int **matrix = (int **)malloc(number_of_lines * sizeof(int *));
+  for (int i = 0; i < number_of_lines; i++) {
+    matrix[i] = (int *)malloc(number_of_columns * sizeof(int));
+  }
+  return matrix;
+}
+
+/*
+  free_matrix
+  Função para liberar uma matriz alocada por allocate_matrix
+*/
+void free_matrix(int **matrix, int number_of_lines) {
+  for (int i = 0; i < number_of_lines; i++) {
+    free(matrix[i]);
+  }
+  free(matrix);
+}
+
+/*
+  save_state
+  Função para salvar a entrada e a saída de uma execução em arquivo
+  O arquivo contém o número de linhas e colunas, seguido da matriz de entrada
+  e da matriz de saída, e é usado como ponto de partida do modo incremental
+
+  O estado é escrito em '<path>.tmp' e só substitui o arquivo anterior depois
+  de completo, para que uma escrita interrompida não perca o último estado
+
+  Retorna falso se não foi possível escrever o arquivo
+*/
+bool save_state(const char *path, int **input, int **output,
+                int number_of_lines, int number_of_columns) {
+  char *temp_path = (char *)malloc(strlen(path) + sizeof(".tmp"));
+  sprintf(temp_path, "%s.tmp", path);
+
+  FILE *file = fopen(temp_path, "w");
+
+  if (file == NULL) {
+    free(temp_path);
+    return false;
+  }
+
+  fprintf(file, "%d %d\n", number_of_lines, number_of_columns);
+
+  int **matrices[2] = {input, output};
+
+  for (int m = 0; m < 2; m++) {
+    for (int i = 0; i < number_of_lines; i++) {
+      for (int j = 0; j < number_of_columns; j++) {
+        fprintf(file, "%d ", matrices[m][i][j]);
+      }
+      fprintf(file, "\n");
+    }
+  }
+
+  bool saved = !ferror(file);
+
+  if (fclose(file) != 0) {
+    saved = false;
+  }
+
+  if (saved) {
+    saved = rename(temp_path, path) == 0;
+  }
+
+  if (!saved) {
+    remove(temp_path);
+  }
+
+  free(temp_path);
+  return saved;
+}
+
+/*
+  load_state
+  Função para carregar a entrada e a saída salvas por save_state
+  As matrizes já devem estar alocadas com o número de linhas e colunas
+  informado, que precisa ser o mesmo do arquivo
+
+  Retorna falso se o arquivo não existe, está incompleto ou tem outra ordem
+*/
+bool load_state(const char *path, int **input, int **output,
+                int number_of_lines, int number_of_columns) {
+  FILE *file = fopen(path, "r");
+
+  if (file == NULL) {
+    return false;
+  }
+
+  int lines_in_file, columns_in_file;
+
+  if (fscanf(file, "%d %d", &lines_in_file, &columns_in_file) != 2 ||
+      lines_in_file != number_of_lines ||
+      columns_in_file != number_of_columns) {
+    fclose(file);
+    return false;
+  }
+
+  int **matrices[2] = {input, output};
+
+  for (int m = 0; m < 2; m++) {
+    for (int i = 0; i < number_of_lines; i++) {
+      for (int j = 0; j < number_of_columns; j++) {
+        if (fscanf(file, "%d", &matrices[m][i][j]) != 1) {
+          fclose(file);
+          return false;
+        }
+      }
+    }
+  }
+
+  fclose(file);
+  return true;
+}
+
+/*
+  matrices_match
+  Função para comparar a matriz calculada com a matriz de referência
+  Informa a primeira posição divergente, se houver
+*/
+bool matrices_match(int **matrix, int **expected, int number_of_lines,
+                    int number_of_columns) {
+  for (int i = 0; i < number_of_lines; i++) {
+    for (int j = 0; j < number_of_columns; j++) {
+      if (matrix[i][j] != expected[i][j]) {
+        info(CONTROLLER_PROCESS,
+             "ERRO! Matrizes diferentes na posição [%d][%d] "
+             "original=%d, final=%d",
+             i, j, expected[i][j], matrix[i][j]);
+
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
 /*
   receive_or_get_item
   Função para receber um elemento de outro processo
@@ -243,14 +627,12 @@ int receive_or_get_item(process_data_t *data, line_data_t *line, int from,
     return line->top_line[i].value;
   }
 
-  int tag = create_tag(DONE_ELEMENT_TAG, line->line_index - 1, i);
+  debug(data->process_id, "Esperando elemento M[%d][%d] de 'PROCESSO-%d'",
+        line->line_index - 1, i, from);
 
-  debug(data->process_id,
-        "Esperando elemento M[%d][%d] de 'PROCESSO-%d' com TAG=0x%x",
-        line->line_index - 1, i, from, tag);
-
-  MPI_Recv(&line->top_line[i].value, 1, MPI_INT, from, tag, MPI_COMM_WORLD,
-           MPI_STATUS_IGNORE);
+  // Os elementos da linha anterior são sempre pedidos em ordem crescente de
+  // coluna, a mesma ordem em que o processo anterior os envia
+  line->top_line[i].value = recv_element(data->comm);
 
   line->top_line[i].recvd = true;
 
@@ -335,6 +717,29 @@ int process_element(process_data_t *data, line_data_t *line, int i) {
   return floor((float)soma / contador);
 }
 
+/*
+  receive_done_lines
+  Função do processo 0 para receber as linhas prontas dos outros processos
+  Espera as requisições iniciadas após a linha prev_line e copia cada linha
+  recebida, prev_line + j do processo j, para a matriz
+*/
+void receive_done_lines(int **matrix, int **done_lines,
+                        MPI_Request *line_requests, int np,
+                        int number_of_columns, int prev_line) {
+  debug(CONTROLLER_PROCESS, "Esperando linhas %d a %d", prev_line + 1,
+        prev_line + np - 1);
+
+  MPI_Waitall(np - 1, line_requests, MPI_STATUSES_IGNORE);
+
+  for (int j = 1; j < np; j++) {
+    memcpy(matrix[prev_line + j], done_lines[j],
+           number_of_columns * sizeof(int));
+  }
+
+  info(CONTROLLER_PROCESS, "Recebido linhas %d a %d", prev_line + 1,
+       prev_line + np - 1);
+}
+
 /*
   control
   Função do processo 0
@@ -343,7 +748,8 @@ int process_element(process_data_t *data, line_data_t *line, int i) {
   Gera a matriz, envia as linhas para os processos e processa as linhas
   Recebe as linhas processadas e valida a matriz final
 */
-void control(int np, int number_of_lines, int number_of_columns) {
+void control(int np, int number_of_lines, int number_of_columns,
+             const char *state_path) {
   int **matrix;
   int **matrix_backup;
 
@@ -404,132 +810,152 @@ void control(int np, int number_of_lines, int number_of_columns) {
     }
   }
 
-  // Aloca e inicializa as linhas que o processo 0 é responsável por processar
+  // Todos os buffers e requisições usados no processamento saem do pool, que
+  // tem o tamanho validado em main antes do início da execução
+  buffer_pool_t pool;
+  pool_init(&pool, CONTROLLER_PROCESS,
+            pool_bytes_needed(CONTROLLER_PROCESS, np, number_of_lines,
+                              number_of_columns));
+
+  comm_t comm;
+  comm_init(&comm, CONTROLLER_PROCESS, np);
+  data.comm = &comm;
+
+  // As linhas são processadas uma de cada vez, então a linha anterior recebida
+  // é a mesma para todas
+  cached_element_t *top_line = (cached_element_t *)pool_take(
+      &pool, number_of_columns * sizeof(cached_element_t));
+
+  // Inicializa as linhas que o processo 0 é responsável por processar
   line_data_t lines[data.lines_to_process];
 
   for (int i = 0; i < lines_per_process; i++) {
     lines[i].line_index = i + i * (np - 1);
     debug(CONTROLLER_PROCESS, "Escolhido linha %d", lines[i].line_index);
     lines[i].current_line = matrix[lines[i].line_index];
-    lines[i].top_line = (cached_element_t *)malloc(number_of_columns *
-                                                   sizeof(cached_element_t));
+    lines[i].top_line = top_line;
 
     if (lines[i].line_index + 1 < number_of_lines) {
       lines[i].next_line = matrix[lines[i].line_index + 1];
     } else {
       lines[i].next_line = NULL;
     }
+  }
 
-    for (int j = 0; j < number_of_columns; j++) {
-      lines[i].top_line[j].recvd = false;
-    }
+  // Cria uma requisição persistente por processo, ligada a uma linha do pool,
+  // reutilizada para receber todas as linhas prontas daquele processo
+  MPI_Request *line_requests =
+      (MPI_Request *)pool_take(&pool, (np - 1) * sizeof(MPI_Request));
+  int *done_lines[np];
+
+  for (int j = 1; j < np; j++) {
+    done_lines[j] = (int *)pool_take(&pool, number_of_columns * sizeof(int));
+
+    MPI_Recv_init(done_lines[j], number_of_columns, MPI_INT, j, DONE_LINE_TAG,
+                  MPI_COMM_WORLD, &line_requests[j - 1]);
   }
 
   // Aguarde que todos os processos tenham recebido suas linhas
   MPI_Barrier(MPI_COMM_WORLD);
 
+  MPI_Startall(np - 1, line_requests);
+
   // Processa cada linha e envia cada elemento processado para o processo
   // vizinho
   for (int i = 0; i < lines_per_process; i++) {
+    for (int j = 0; j < number_of_columns; j++) {
+      top_line[j].recvd = false;
+    }
+
+    // Os elementos da última linha da matriz não são usados por nenhum processo
+    bool send_elements = lines[i].line_index + 1 < number_of_lines;
+
     for (int j = 0; j < number_of_columns; j++) {
       int result = process_element(&data, &lines[i], j);
       matrix[lines[i].line_index][j] = result;
 
-      int tag = create_tag(DONE_ELEMENT_TAG, lines[i].line_index, j);
-
-      info(CONTROLLER_PROCESS,
-           "Concluído elemento M[%d][%d] enviando para "
-           "'PROCESSO-%d'",
-           lines[i].line_index, j, next_process_id);
+      if (send_elements) {
+        info(CONTROLLER_PROCESS,
+             "Concluído elemento M[%d][%d] enviando para "
+             "'PROCESSO-%d'",
+             lines[i].line_index, j, next_process_id);
 
-      MPI_Send(&result, 1, MPI_INT, next_process_id, tag, MPI_COMM_WORLD);
+        send_element(&comm, result);
+      }
     }
 
     info(CONTROLLER_PROCESS, "Concluído linha %d", lines[i].line_index);
 
     // Ao terminar uma linha, espera todas as linhas anteriores serem
-    // processadas e as recebe
+    // processadas e as recebe, liberando as requisições para as seguintes
     if (i > 0) {
-      int prev_completed_line = lines[i - 1].line_index;
-
-      for (int j = 1; j < np; j++) {
-        int done_line[number_of_columns];
-
-        int tag = create_tag(DONE_LINE_TAG, prev_completed_line + j, 0);
-
-        debug(CONTROLLER_PROCESS,
-              "Esperando linha %d de 'PROCESSO-%d' com "
-              "TAG=0x%x",
-              prev_completed_line + j, j, tag);
-
-        MPI_Recv(done_line, number_of_columns, MPI_INT, j, tag, MPI_COMM_WORLD,
-                 MPI_STATUS_IGNORE);
-
-        info(CONTROLLER_PROCESS, "Recebido linha %d de 'PROCESSO-%d'",
-             prev_completed_line + j, j);
+      receive_done_lines(matrix, done_lines, line_requests, np,
+                         number_of_columns, lines[i - 1].line_index);
 
-        // Atualiza a linha na matriz
-        for (int k = 0; k < number_of_columns; k++) {
-          matrix[prev_completed_line + j][k] = done_line[k];
-        }
-      }
+      MPI_Startall(np - 1, line_requests);
     }
   }
 
   // Caso especial onde o processo-0 não process a última linha da matriz
   // Aqui espera as linhas seguintes serem processadas e as recebe
-  line_data_t *last_processed = &lines[lines_per_process - 1];
-
-  if (last_processed->line_index < number_of_lines) {
-    int last_line_index = last_processed->line_index;
+  receive_done_lines(matrix, done_lines, line_requests, np, number_of_columns,
+                     lines[lines_per_process - 1].line_index);
 
-    for (int j = 1; j < np; j++) {
-      int done_line[number_of_columns];
-
-      int tag = create_tag(DONE_LINE_TAG, last_line_index + j, 0);
-
-      debug(CONTROLLER_PROCESS,
-            "Esperando linha %d de 'PROCESSO-%d' com "
-            "TAG=0x%x",
-            last_line_index + j, j, tag);
+  // Aguarde que todos os processos tenham processado suas linhas
+  MPI_Barrier(MPI_COMM_WORLD);
 
-      MPI_Recv(done_line, number_of_columns, MPI_INT, j, tag, MPI_COMM_WORLD,
-               MPI_STATUS_IGNORE);
+  for (int j = 0; j < np - 1; j++) {
+    MPI_Request_free(&line_requests[j]);
+  }
 
-      info(CONTROLLER_PROCESS, "Recebido linha %d de 'PROCESSO-%d'",
-           last_line_index + j, j);
+  comm_free(&comm);
 
-      for (int k = 0; k < number_of_columns; k++) {
-        matrix[last_line_index + j][k] = done_line[k];
-      }
-    }
-  }
+  report_memory(CONTROLLER_PROCESS, &pool,
+                controller_matrix_bytes(number_of_lines, number_of_columns,
+                                        state_path != NULL));
 
-  // Aguarde que todos os processos tenham processado suas linhas
-  MPI_Barrier(MPI_COMM_WORLD);
+  pool_free(&pool);
 
   info(CONTROLLER_PROCESS, "Matriz final");
 
   display_matrix(matrix, number_of_lines, number_of_columns);
 
-  validador(matrix_backup, number_of_lines, number_of_columns);
+  // O validador altera a matriz recebida, então a entrada original só é
+  // copiada quando precisa ser preservada para ser salva no estado
+  int **expected = matrix_backup;
 
-  // Valida a matriz final
-  for (int i = 0; i < number_of_lines; i++) {
-    for (int j = 0; j < number_of_columns; j++) {
-      if (matrix[i][j] != matrix_backup[i][j]) {
-        info(CONTROLLER_PROCESS,
-             "ERRO! Matrizes diferentes na posição [%d][%d] "
-             "original=%d, final=%d",
-             i, j, matrix_backup[i][j], matrix[i][j]);
+  if (state_path != NULL) {
+    expected = allocate_matrix(number_of_lines, number_of_columns);
 
-        MPI_Finalize();
-        exit(1);
-      }
+    for (int i = 0; i < number_of_lines; i++) {
+      memcpy(expected[i], matrix_backup[i], number_of_columns * sizeof(int));
     }
   }
 
+  validador(expected, number_of_lines, number_of_columns);
+
+  // Valida a matriz final
+  if (!matrices_match(matrix, expected, number_of_lines, number_of_columns)) {
+    MPI_Finalize();
+    exit(1);
+  }
+
   info(CONTROLLER_PROCESS, "Matriz resultado validada com sucesso!");
+
+  if (expected != matrix_backup) {
+    free_matrix(expected, number_of_lines);
+  }
+
+  // Salva a entrada e a saída para que o modo incremental possa partir delas
+  if (state_path != NULL) {
+    if (save_state(state_path, matrix_backup, matrix, number_of_lines,
+                   number_of_columns)) {
+      info(CONTROLLER_PROCESS, "Estado salvo em '%s'", state_path);
+    } else {
+      info(CONTROLLER_PROCESS, "ERRO! Não foi possível salvar o estado em '%s'",
+           state_path);
+    }
+  }
 }
 
 /*
@@ -558,17 +984,37 @@ void node(int id, int np, int number_of_lines, int number_of_columns) {
   info(id, "Recebido número de linhas para processar %d",
        data.lines_to_process);
 
+  // Todos os buffers e requisições usados no processamento saem do pool, que
+  // tem o tamanho validado em main antes do início da execução
+  buffer_pool_t pool;
+  pool_init(&pool, id,
+            pool_bytes_needed(id, np, number_of_lines, number_of_columns));
+
+  comm_t comm;
+  comm_init(&comm, id, np);
+  data.comm = &comm;
+
+  // As linhas são processadas uma de cada vez, então a linha anterior recebida
+  // é a mesma para todas
+  cached_element_t *top_line = (cached_element_t *)pool_take(
+      &pool, number_of_columns * sizeof(cached_element_t));
+
   line_data_t lines[data.lines_to_process];
 
-  // Aloca e recebe do processo-0 cada uma das linhas a serem processadas
-  for (int i = 0; i < data.lines_to_process; i++) {
-    lines[i].current_line = (int *)malloc(data.number_of_columns * sizeof(int));
-    lines[i].top_line = (cached_element_t *)malloc(data.number_of_columns *
-                                                   sizeof(cached_element_t));
+  // Uma única requisição persistente, ligada a uma linha do pool, devolve todas
+  // as linhas prontas ao processo-0
+  int *done_line = (int *)pool_take(&pool, number_of_columns * sizeof(int));
+  MPI_Request line_request;
+  bool line_pending = false;
 
-    for (int j = 0; j < data.number_of_columns; j++) {
-      lines[i].top_line[j].recvd = false;
-    }
+  MPI_Send_init(done_line, number_of_columns, MPI_INT, CONTROLLER_PROCESS,
+                DONE_LINE_TAG, MPI_COMM_WORLD, &line_request);
+
+  // Recebe do processo-0 cada uma das linhas a serem processadas
+  for (int i = 0; i < data.lines_to_process; i++) {
+    lines[i].current_line =
+        (int *)pool_take(&pool, data.number_of_columns * sizeof(int));
+    lines[i].top_line = top_line;
 
     MPI_Recv(&lines[i].line_index, 1, MPI_INT, CONTROLLER_PROCESS,
              LINE_INDEX_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
@@ -578,7 +1024,8 @@ void node(int id, int np, int number_of_lines, int number_of_columns) {
              MPI_STATUS_IGNORE);
 
     if (lines[i].line_index + 1 < data.number_of_lines) {
-      lines[i].next_line = (int *)malloc(data.number_of_columns * sizeof(int));
+      lines[i].next_line =
+          (int *)pool_take(&pool, data.number_of_columns * sizeof(int));
 
       MPI_Recv(lines[i].next_line, data.number_of_columns, MPI_INT,
                CONTROLLER_PROCESS, NEXT_LINE_TAG, MPI_COMM_WORLD,
@@ -593,41 +1040,322 @@ void node(int id, int np, int number_of_lines, int number_of_columns) {
   // Aguarde que todos os processos tenham recebido suas linhas
   MPI_Barrier(MPI_COMM_WORLD);
 
-  int done_line[data.number_of_columns];
-
   // Processa cada linha e envia cada elemento processado para o processo
   // seguinte
   for (int i = 0; i < data.lines_to_process; i++) {
     for (int j = 0; j < data.number_of_columns; j++) {
-      done_line[j] = process_element(&data, &lines[i], j);
-      lines[i].current_line[j] = done_line[j];
-      int tag = create_tag(DONE_ELEMENT_TAG, lines[i].line_index, j);
+      top_line[j].recvd = false;
+    }
+
+    // Os elementos da última linha da matriz não são usados por nenhum processo
+    bool send_elements = lines[i].line_index + 1 < data.number_of_lines;
+
+    for (int j = 0; j < data.number_of_columns; j++) {
+      lines[i].current_line[j] = process_element(&data, &lines[i], j);
 
-      info(id,
-           "Concluído elemento M[%d][%d] enviando para "
-           "'PROCESSO-%d'",
-           lines[i].line_index, j, next_process_id);
+      if (send_elements) {
+        info(id,
+             "Concluído elemento M[%d][%d] enviando para "
+             "'PROCESSO-%d'",
+             lines[i].line_index, j, next_process_id);
 
-      MPI_Send(&done_line[j], 1, MPI_INT, next_process_id, tag, MPI_COMM_WORLD);
+        send_element(&comm, lines[i].current_line[j]);
+      }
     }
 
     // Envia a linha inteira processada para o processo-0
 
     info(id, "Concluído linha %d", lines[i].line_index);
 
-    int tag = create_tag(DONE_LINE_TAG, lines[i].line_index, 0);
-
     info(id,
          "Enviando linha processada %d para "
          "'PROCESSO-%d'",
          lines[i].line_index, CONTROLLER_PROCESS);
 
-    MPI_Send(done_line, data.number_of_columns, MPI_INT, CONTROLLER_PROCESS,
-             tag, MPI_COMM_WORLD);
+    // Aguarda o envio da linha anterior para reaproveitar o buffer
+    if (line_pending) {
+      MPI_Wait(&line_request, MPI_STATUS_IGNORE);
+    }
+
+    memcpy(done_line, lines[i].current_line,
+           data.number_of_columns * sizeof(int));
+    MPI_Start(&line_request);
+    line_pending = true;
+  }
+
+  if (line_pending) {
+    MPI_Wait(&line_request, MPI_STATUS_IGNORE);
   }
 
+  MPI_Request_free(&line_request);
+
+  comm_free(&comm);
+
   // Aguarde que todos os processos tenham processado suas linhas
   MPI_Barrier(MPI_COMM_WORLD);
+
+  report_memory(id, &pool, 0);
+
+  pool_free(&pool);
+}
+
+/*
+  process_line_span
+  Função para recalcular uma linha a partir de uma coluna
+  Os elementos anteriores a first_column já devem estar com o valor final em
+  current_line, e a linha anterior já deve estar inteira em top_line
+*/
+void process_line_span(process_data_t *data, line_data_t *line,
+                       int first_column) {
+  for (int j = first_column; j < data->number_of_columns; j++) {
+    line->current_line[j] = process_element(data, line, j);
+  }
+}
+
+/*
+  load_changes
+  Função para aplicar na matriz de entrada as alterações de um arquivo
+  Cada linha do arquivo contém "linha coluna valor"
+
+  Cada célula alterada afeta a saída dos seus vizinhos que a leem com o valor
+  original: a linha de cima a partir da coluna anterior e o vizinho da
+  esquerda. Em first_column fica, para cada linha, a primeira coluna afetada
+  (number_of_columns quando a linha não é afetada)
+
+  Retorna falso se o arquivo não existe ou contém uma alteração inválida
+*/
+bool load_changes(const char *path, int **input, int *first_column,
+                  int number_of_lines, int number_of_columns) {
+  FILE *file = fopen(path, "r");
+
+  if (file == NULL) {
+    return false;
+  }
+
+  int line_index, column_index, value;
+  int read;
+
+  while ((read = fscanf(file, "%d %d %d", &line_index, &column_index,
+                        &value)) == 3) {
+    if (line_index < 0 || line_index >= number_of_lines || column_index < 0 ||
+        column_index >= number_of_columns || value < 0 || value > 9) {
+      info(CONTROLLER_PROCESS, "ERRO! Alteração inválida M[%d][%d]=%d",
+           line_index, column_index, value);
+      fclose(file);
+      return false;
+    }
+
+    if (input[line_index][column_index] == value) {
+      continue;
+    }
+
+    input[line_index][column_index] = value;
+
+    int affected_column = column_index > 0 ? column_index - 1 : 0;
+
+    if (line_index > 0 && affected_column < first_column[line_index - 1]) {
+      first_column[line_index - 1] = affected_column;
+    }
+
+    if (column_index > 0 && affected_column < first_column[line_index]) {
+      first_column[line_index] = affected_column;
+    }
+  }
+
+  fclose(file);
+  return read == EOF;
+}
+
+/*
+  incremental_control
+  Função do processo 0 no modo incremental
+  Carrega a entrada e a saída da execução anterior, aplica as alterações e
+  recalcula apenas a partir da primeira linha e coluna afetadas. Como a linha
+  anterior de cada linha afetada já está pronta no processo 0, as linhas são
+  recalculadas aqui mesmo, sem enviar nada aos demais processos
+
+  A propagação para assim que uma linha recalculada fica igual à saída
+  anterior e não há mais alterações abaixo dela
+
+  A validação recalcula a matriz inteira, então só é feita quando validate é
+  verdadeiro. Nesse caso o estado só é salvo se o resultado for válido
+
+  Retorna falso em caso de erro nos arquivos ou na validação
+*/
+bool incremental_control(int number_of_lines, int number_of_columns,
+                         const char *state_path, const char *changes_path,
+                         bool validate) {
+  int **input = allocate_matrix(number_of_lines, number_of_columns);
+  int **previous_output = allocate_matrix(number_of_lines, number_of_columns);
+
+  // Os buffers usados no recálculo saem do pool, que tem o tamanho validado
+  // antes do início da execução
+  buffer_pool_t pool;
+  pool_init(&pool, CONTROLLER_PROCESS,
+            incremental_pool_bytes_needed(number_of_lines, number_of_columns));
+
+  int *first_column = (int *)pool_take(&pool, number_of_lines * sizeof(int));
+
+  for (int i = 0; i < number_of_lines; i++) {
+    first_column[i] = number_of_columns;
+  }
+
+  if (!load_state(state_path, input, previous_output, number_of_lines,
+                  number_of_columns)) {
+    info(CONTROLLER_PROCESS, "ERRO! Estado inválido em '%s'", state_path);
+    pool_free(&pool);
+    free_matrix(input, number_of_lines);
+    free_matrix(previous_output, number_of_lines);
+    return false;
+  }
+
+  if (!load_changes(changes_path, input, first_column, number_of_lines,
+                    number_of_columns)) {
+    info(CONTROLLER_PROCESS, "ERRO! Alterações inválidas em '%s'",
+         changes_path);
+    pool_free(&pool);
+    free_matrix(input, number_of_lines);
+    free_matrix(previous_output, number_of_lines);
+    return false;
+  }
+
+  int first_affected_line = number_of_lines;
+  int last_affected_line = -1;
+
+  for (int i = 0; i < number_of_lines; i++) {
+    if (first_column[i] < number_of_columns) {
+      if (first_affected_line == number_of_lines) {
+        first_affected_line = i;
+      }
+      last_affected_line = i;
+    }
+  }
+
+  // A saída começa igual à anterior e só as linhas afetadas são substituídas
+  int **matrix = allocate_matrix(number_of_lines, number_of_columns);
+
+  for (int i = 0; i < number_of_lines; i++) {
+    memcpy(matrix[i], previous_output[i], number_of_columns * sizeof(int));
+  }
+
+  process_data_t data;
+  data.process_id = CONTROLLER_PROCESS;
+  data.process_count = 1;
+  data.number_of_lines = number_of_lines;
+  data.number_of_columns = number_of_columns;
+  data.lines_to_process = 0;
+  data.comm = NULL;
+
+  line_data_t line;
+  line.top_line = (cached_element_t *)pool_take(
+      &pool, number_of_columns * sizeof(cached_element_t));
+
+  // Primeira coluna alterada na linha anterior em relação à saída anterior
+  int changed_column = number_of_columns;
+
+  for (int i = first_affected_line; i < number_of_lines; i++) {
+    int start = first_column[i];
+
+    if (changed_column < number_of_columns) {
+      int below_changed = changed_column > 0 ? changed_column - 1 : 0;
+
+      if (below_changed < start) {
+        start = below_changed;
+      }
+    }
+
+    if (start == number_of_columns) {
+      // Linha não afetada, mantém a saída anterior sem recalcular
+      if (i >= last_affected_line) {
+        break;
+      }
+      continue;
+    }
+
+    int base = start > 0 ? start - 1 : 0;
+
+    // A linha é recalculada na própria matriz. Os elementos antes de start não
+    // mudam, então o vizinho da esquerda já é o valor final da saída anterior
+    line.line_index = i;
+    line.current_line = matrix[i];
+    line.next_line = i + 1 < number_of_lines ? input[i + 1] : NULL;
+
+    memcpy(matrix[i] + start, input[i] + start,
+           (number_of_columns - start) * sizeof(int));
+
+    if (i > 0) {
+      for (int j = base; j < number_of_columns; j++) {
+        line.top_line[j].value = matrix[i - 1][j];
+        line.top_line[j].recvd = true;
+      }
+    }
+
+    process_line_span(&data, &line, start);
+
+    debug(CONTROLLER_PROCESS, "Recalculada linha %d a partir da coluna %d", i,
+          start);
+
+    data.lines_to_process++;
+
+    changed_column = number_of_columns;
+
+    for (int j = start; j < number_of_columns; j++) {
+      if (matrix[i][j] != previous_output[i][j]) {
+        changed_column = j;
+        break;
+      }
+    }
+
+    if (changed_column == number_of_columns && i >= last_affected_line) {
+      debug(CONTROLLER_PROCESS, "Linha %d igual à saída anterior, parando", i);
+      break;
+    }
+  }
+
+  info(CONTROLLER_PROCESS, "Linhas recalculadas %d de %d",
+       data.lines_to_process, number_of_lines);
+
+  info(CONTROLLER_PROCESS, "Matriz final");
+
+  display_matrix(matrix, number_of_lines, number_of_columns);
+
+  bool valid = true;
+
+  if (validate) {
+    // A saída anterior não é mais necessária e passa a guardar a matriz de
+    // referência, preservando a nova entrada para ser salva
+    for (int i = 0; i < number_of_lines; i++) {
+      memcpy(previous_output[i], input[i], number_of_columns * sizeof(int));
+    }
+
+    validador(previous_output, number_of_lines, number_of_columns);
+
+    valid = matrices_match(matrix, previous_output, number_of_lines,
+                           number_of_columns);
+
+    if (valid) {
+      info(CONTROLLER_PROCESS, "Matriz resultado validada com sucesso!");
+    }
+  }
+
+  // Só um resultado validado substitui o estado da próxima execução incremental
+  if (valid && !save_state(state_path, input, matrix, number_of_lines,
+                           number_of_columns)) {
+    info(CONTROLLER_PROCESS, "ERRO! Não foi possível salvar o estado em '%s'",
+         state_path);
+    valid = false;
+  }
+
+  report_memory(
+      CONTROLLER_PROCESS, &pool,
+      incremental_matrix_bytes(number_of_lines, number_of_columns));
+
+  pool_free(&pool);
+  free_matrix(input, number_of_lines);
+  free_matrix(previous_output, number_of_lines);
+  free_matrix(matrix, number_of_lines);
+
+  return valid;
 }
 
 int main(int argc, char *argv[]) {
@@ -644,7 +1372,9 @@ int main(int argc, char *argv[]) {
       printf(
           "Número de argumentos inválido! forneça linhas e colunas na linha de "
           "comando!\n");
-      printf("mpirun -np <proc> <programa> <linhas> <colunas>\n");
+      printf(
+          "mpirun -np <proc> <programa> <linhas> <colunas> [estado] "
+          "[alteracoes] [--validar]\n");
     }
 
     MPI_Finalize();
@@ -662,6 +1392,57 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
+  // Com o arquivo de estado, a execução completa salva entrada e saída nele
+  // Com o arquivo de alterações também, executa o modo incremental
+  const char *estado = argc > 3 ? argv[3] : NULL;
+  const char *alteracoes = argc > 4 ? argv[4] : NULL;
+
+  // No modo incremental a validação recalcula a matriz inteira, por isso só é
+  // feita quando pedida
+  const bool validar = argc > 5 && strcmp(argv[5], "--validar") == 0;
+
+  // Verifica antes de começar se a memória de todos os processos cabe no
+  // limite, para que nenhum processo comece a execução sozinho. No modo
+  // incremental apenas o processo 0 trabalha
+  const size_t limite_memoria = (size_t)MAX_MEMORY_BYTES;
+  bool memoria_excedida;
+
+  if (alteracoes != NULL) {
+    memoria_excedida = incremental_pool_bytes_needed(linhas, colunas) +
+                           incremental_matrix_bytes(linhas, colunas) >
+                       limite_memoria;
+  } else {
+    memoria_excedida =
+        pool_bytes_needed(CONTROLLER_PROCESS, np, linhas, colunas) +
+                controller_matrix_bytes(linhas, colunas, estado != NULL) >
+            limite_memoria ||
+        (np > 1 && pool_bytes_needed(CONTROLLER_PROCESS + 1, np, linhas,
+                                     colunas) > limite_memoria);
+  }
+
+  if (memoria_excedida) {
+    if (id == CONTROLLER_PROCESS) {
+      printf("Memória necessária excede o limite de %zu bytes por processo!\n",
+             limite_memoria);
+    }
+    MPI_Finalize();
+    return 1;
+  }
+
+  // Os demais processos não participam do modo incremental, então o número de
+  // linhas não precisa ser divisível pelo número de processos
+  if (alteracoes != NULL) {
+    bool sucesso = true;
+
+    if (id == CONTROLLER_PROCESS) {
+      sucesso =
+          incremental_control(linhas, colunas, estado, alteracoes, validar);
+    }
+
+    MPI_Finalize();
+    return sucesso ? 0 : 1;
+  }
+
   if (linhas % np != 0) {
     if (id == CONTROLLER_PROCESS) {
       printf("Número de linhas deve ser divisível pelo número de processos!\n");
@@ -671,7 +1452,7 @@ int main(int argc, char *argv[]) {
   }
 
   if (id == CONTROLLER_PROCESS) {
-    control(np, linhas, colunas);
+    control(np, linhas, colunas, estado);
   } else {
     node(id, np, linhas, colunas);
   }